@@ -14,6 +14,13 @@ if length(ts) ~= length(addr)
     error('mismatched data in the files!');
 end
 
+%% remove gap records
+% each time range lost after a camera memory overflow is marked by a pair
+% of events with address 65535, holding the start and the end of the gap.
+gap=addr==65535;
+ts=ts(~gap);
+addr=addr(~gap);
+
 %% hit 2d map
 figure(1)
 draw_colormap(addr,true); % second parameter: enable/disable pixel number on map
@@ -15,6 +15,19 @@ if length(ts) ~= length(addr)
     error('mismatched data in the files!');
 end
 
+%% remove gap records
+% after a camera memory overflow the acquisition is restarted: each lost
+% time range is marked by a pair of events with address 65535, holding the
+% start and the end of the gap.
+gap=addr==65535;
+gaps=reshape(ts(gap),2,[])';
+ts=ts(~gap);
+addr=addr(~gap);
+if ~isempty(gaps)
+    fprintf('%d gaps in the data, %.3f ms lost\n', size(gaps,1), ...
+        double(sum(gaps(:,2)-gaps(:,1)))*2e-6);
+end
+
 %% plot a subset of the data
 pr_len=1000; % how many events to plot
 if length(ts) < pr_len
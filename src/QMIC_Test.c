@@ -16,9 +16,15 @@
 // Support functions and macro definitions ---------------------------------------------------------
 void clear_last_N_chars(int n_chars);
 void draw_map(uint32_t *frame, uint8_t first_line);
+int64_t host_time_2ns(void);
+uint16_t shed_hot_pixels(uint32_t *counts, uint16_t *off_list, uint16_t n_off, uint16_t n_shed);
 
 #define CHECK_ERR_EXIT(x, y) {if(QMIC_HelpPrintErrorCode(x, y, NULL)){return -1;}}
 #define CHECK_ERR_ESCAPE(x, y) {if(QMIC_HelpPrintErrorCode(x, y, NULL)){goto escape;}}
+#define IS_OVERLOAD_ERR(x)     ((x) == ERR_FIFO_FULL || (x) == ERR_GET_DATA_TIMEOUT)
+
+#define QMIC_FIFO_LEN  (32*1024*1024) //< size of the camera memory (words)
+#define GAP_ADDR       0xFFFF         //< pixel address that marks a gap record in decoded data
 
 // User defined settings ---------------------------------------------------------------------------
 #define SHOW_LIVE             1 //< 0: save data to file; 1: show live intensity image
@@ -30,6 +36,17 @@ void draw_map(uint32_t *frame, uint8_t first_line);
 #define DECODE_DATA           1 //< set to 1 to activate data decoding
 #define SAVE_CAMERA_DATA      0 //< set to 1 to save camera data to file
 #define SAVE_DECODED_DATA     1 //< set to 1 to save decoded data to file
+#define RECOVER_ON_OVERLOAD   1 //< set to 1 to resync and go on after a camera memory overflow
+#define MAX_RECOVERIES       10 //< abort after this many consecutive overflows
+#define LOAD_SHEDDING         0 //< set to 1 to turn off the hottest pixels when the memory fills up
+#define SHED_FILL_THRESHOLD   (QMIC_FIFO_LEN / 2) //< memory fill (words) that triggers shedding
+#define SHED_STEP_PIXELS      4 //< how many pixels are turned off at each shedding step
+#define SHED_MAX_PIXELS      64 //< max number of pixels turned off by shedding
+#define SHED_RESTORE_FILL     (2 * N_EVENTS) //< memory fill (words) considered "quiet"
+#define SHED_RESTORE_CHUNKS  20 //< quiet chunks before turning shed pixels on again; 0 to disable
+#if LOAD_SHEDDING && !(RECOVER_ON_OVERLOAD && DECODE_DATA)
+#error "LOAD_SHEDDING requires RECOVER_ON_OVERLOAD and DECODE_DATA"
+#endif
 #endif
 #define READOUT_TIME       1000 //< readout time (4 ns per unit); set to 0 for adaptive readout.
 #define WARMUP_TIME          10 //< time (s) to wait before acquiring "real" data; set to 0 to disable.
@@ -67,6 +84,30 @@ int main() {
 	FILE *decoded_addr_file;
 #endif
 
+#if RECOVER_ON_OVERLOAD
+	QBOOL stopped = FALSE;     //< acquisition stopped: drain the camera memory, then restart
+	QBOOL gap_pending = FALSE; //< acquisition has been stopped: record a gap at the restart
+	int n_recoveries = 0;      //< consecutive overflows, without valid data in between
+	char *err_fn;              //< name of the function that reported the overflow
+	int64_t seg_base_ts;       //< base timestamp of the current acquisition segment
+	int64_t t_seg_start;       //< host time at which the current acquisition segment started
+#if !DECODE_DATA
+	int64_t last_ts = 0;       //< time of the last downloaded data, estimated with the host clock
+#endif
+#if SAVE_CAMERA_DATA
+	FILE *camera_gaps_file = NULL;
+	uint64_t words_saved = 0;
+#endif
+#endif
+#if LOAD_SHEDDING
+	uint32_t pix_counts[QMIC_NPIXELS] = {0}; //< events per pixel in the last decoded chunk
+	uint16_t off_list[QMIC_NPIXELS];         //< pixels turned off: bad pixels first, then shed ones
+	uint16_t n_bad = DEACTIVATE_BAD_PIXELS ? BAD_PIX_LEN : 0;
+	uint16_t n_off = n_bad;
+	int quiet_chunks = 0;
+	memcpy(off_list, bad_pix_list, n_bad * sizeof(uint16_t));
+#endif
+
 	// === Banner ===
 	printf("====================================================================\n");
 	printf("   QMIC Example program                                             \n");
@@ -119,6 +160,16 @@ int main() {
 		goto escape;
 	}
 #endif
+#if SAVE_CAMERA_DATA && RECOVER_ON_OVERLOAD
+	// one record for each gap, made of 3 x int64 values: number of words written in data_out.dat
+	// before the gap, start and end of the gap (same time base of the decoded timestamps, 2 ns).
+	// Without DECODE_DATA, the start of the gap is estimated with the host clock.
+	camera_gaps_file = fopen("data_gaps_out.dat", "wb");
+	if(camera_gaps_file == NULL) {
+		printf("(ERROR) QMIC_Test.c: data_gaps_out.dat fopen error.\n");
+		goto escape;
+	}
+#endif
 
 	// === Initial configuration ===
 	printf("Configuring Camera\n");
@@ -198,13 +249,83 @@ int main() {
 
 	stat = QMIC_Start(q); //< start the acquisition; events will accumulate in the camera memory
 	CHECK_ERR_ESCAPE(stat, "QMIC_Start");
+#if RECOVER_ON_OVERLOAD
+	seg_base_ts = last_ts;
+	t_seg_start = host_time_2ns();
+#endif
 
 	for(int r = 0; r < N_REPETITIONS; r++) {
-		printf("% 3d. Wait for %d events: ", r, N_EVENTS);
+		uint32_t len = N_EVENTS; //< words to download; less only when draining a stopped acquisition
 		int last_chars = 0;
+#if RECOVER_ON_OVERLOAD
+		if(stopped) {
+			stat = QMIC_GetNDataAvailable(q, &aval_events);
+			if(IS_OVERLOAD_ERR(stat)) {
+				err_fn = "QMIC_GetNDataAvailable";
+				goto handle_overload;
+			}
+			CHECK_ERR_ESCAPE(stat, "QMIC_GetNDataAvailable");
+			if(aval_events == 0) { //< camera memory drained: restart the acquisition
+				// discard the last words (less than 256), if any: they cannot be downloaded, and
+				// they fall in the gap recorded below
+				stat = QMIC_FlushData(q);
+				CHECK_ERR_ESCAPE(stat, "QMIC_FlushData");
+#if LOAD_SHEDDING
+				stat = QMIC_SetBadPixels(q, off_list, n_off); //< apply the new set of disabled pixels
+				CHECK_ERR_ESCAPE(stat, "QMIC_SetBadPixels");
+				quiet_chunks = 0;
+#endif
+				stat = QMIC_Start(q);
+				CHECK_ERR_ESCAPE(stat, "QMIC_Start");
+				stopped = FALSE;
+
+				// estimate the camera time of the restart with the host clock, so that the
+				// timestamps of the new segment continue those of the previous one
+				int64_t t_restart = host_time_2ns();
+				int64_t base_ts = seg_base_ts + (t_restart - t_seg_start);
+				if(base_ts < last_ts) {
+					base_ts = last_ts;
+				}
+				if(gap_pending) {
+					int64_t gap_ts[2] = {last_ts, base_ts}; //< lost time range
+#if SAVE_CAMERA_DATA
+					int64_t gap_rec[3] = {(int64_t)words_saved, gap_ts[0], gap_ts[1]};
+					fwrite(gap_rec, sizeof(int64_t), 3, camera_gaps_file);
+#endif
+#if SAVE_DECODED_DATA && DECODE_DATA
+					uint16_t gap_addr[2] = {GAP_ADDR, GAP_ADDR};
+					fwrite(gap_ts, sizeof(int64_t), 2, decoded_ts_file);
+					fwrite(gap_addr, sizeof(uint16_t), 2, decoded_addr_file);
+#endif
+					printf("     resync: %.3f ms gap\n", (gap_ts[1] - gap_ts[0]) * 2e-6);
+					gap_pending = FALSE;
+				}
+#if LOAD_SHEDDING
+				printf("     restart: %d pixels shed\n", n_off - n_bad);
+#endif
+				seg_base_ts = base_ts;
+				t_seg_start = t_restart;
+				last_ts = base_ts; //< base timestamp for the first chunk of the new segment
+			}
+		}
+#endif
+		printf("% 3d. Wait for %d events: ", r, N_EVENTS);
 		do {
 			stat = QMIC_GetNDataAvailable(q, &aval_events);   //< query how many events are
-			CHECK_ERR_ESCAPE(stat, "QMIC_GetNDataAvailable"); //  available in the camera memory
+			                                                  //  available in the camera memory
+#if RECOVER_ON_OVERLOAD
+			if(IS_OVERLOAD_ERR(stat)) {
+				err_fn = "QMIC_GetNDataAvailable";
+				break; //< handled below, together with the errors returned by QMIC_GetData()
+			}
+#endif
+			CHECK_ERR_ESCAPE(stat, "QMIC_GetNDataAvailable");
+#if RECOVER_ON_OVERLOAD
+			if(stopped && aval_events < N_EVENTS) {
+				len = aval_events; //< acquisition stopped: download what is left in the memory
+				break;
+			}
+#endif
 
 			// print progress and exit if 'q' is pressed
 			clear_last_N_chars(last_chars);
@@ -215,33 +336,113 @@ int main() {
 			}
 		} while(aval_events < N_EVENTS);
 
-		clear_last_N_chars(last_chars);
-		last_chars = printf("getting data");
-		stat = QMIC_GetData(q, data_buf, N_EVENTS); //< download N_EVENTS from camera to the PC
+		if(stat == OK) {
+			clear_last_N_chars(last_chars);
+			last_chars = printf("getting data");
+			stat = QMIC_GetData(q, data_buf, len); //< download len words from camera to the PC
+#if RECOVER_ON_OVERLOAD
+			err_fn = "QMIC_GetData";
+#endif
+		}
+#if RECOVER_ON_OVERLOAD
+handle_overload: //< jump to here when the camera memory overflows while the acquisition is stopped
+		if(IS_OVERLOAD_ERR(stat)) {
+			// data already in the camera is no longer contiguous with the previous chunk: discard
+			// it, restart the acquisition and acquire this chunk again.
+			QMIC_Status overload = stat;
+			clear_last_N_chars(last_chars);
+			QMIC_HelpPrintErrorCode(overload, err_fn, NULL);
+			if(++n_recoveries > MAX_RECOVERIES) {
+				printf("(ERROR) QMIC_Test.c: too many consecutive overflows.\n");
+				goto escape;
+			}
+			stat = QMIC_Stop(q);
+			CHECK_ERR_ESCAPE(stat, "QMIC_Stop");
+			stat = QMIC_FlushData(q);
+			CHECK_ERR_ESCAPE(stat, "QMIC_FlushData");
+#if LOAD_SHEDDING
+			if(overload == ERR_FIFO_FULL) { //< a timeout means too few events: do not shed
+				n_off = shed_hot_pixels(pix_counts, off_list, n_off,
+				                        min(SHED_STEP_PIXELS, n_bad + SHED_MAX_PIXELS - n_off));
+			}
+#endif
+			stopped = TRUE;
+			gap_pending = TRUE;
+			r--; //< acquire the lost chunk again
+			continue;
+		}
+		n_recoveries = 0;
+#if !DECODE_DATA
+		last_ts = seg_base_ts + (host_time_2ns() - t_seg_start);
+#endif
+#endif
 		CHECK_ERR_ESCAPE(stat, "QMIC_GetData");
 
 #if SAVE_CAMERA_DATA
 		clear_last_N_chars(last_chars);
 		last_chars = printf("saving data ");
-		fwrite(data_buf, sizeof(uint32_t), N_EVENTS, camera_data_file); //< save camera data to file
+		fwrite(data_buf, sizeof(uint32_t), len, camera_data_file); //< save camera data to file
+#if RECOVER_ON_OVERLOAD
+		words_saved += len;
+#endif
 #endif
 
 #if DECODE_DATA
 		clear_last_N_chars(last_chars);
 		last_chars = printf("processing data");
-		stat = QMIC_HelpDecodeData64(data_buf, N_EVENTS, ts, addr, last_ts);
+		stat = QMIC_HelpDecodeData64(data_buf, len, ts, addr, last_ts);
 		CHECK_ERR_ESCAPE(stat, "QMIC_HelpDecodeData64");
-		last_ts = ts[N_EVENTS - 1]; //< keep last timestamp for the next decoding
+		last_ts = ts[len - 1]; //< keep last timestamp for the next decoding
+#endif
+#if LOAD_SHEDDING
+		memset(pix_counts, 0, sizeof(pix_counts));
+		for(uint32_t k = 0; k < len; k++) {
+			if(addr[k] < QMIC_NPIXELS) {
+				pix_counts[addr[k]]++;
+			}
+		}
 #endif
 #if SAVE_DECODED_DATA && DECODE_DATA
 		clear_last_N_chars(last_chars);
 		last_chars = printf("saving decoded data");
-		fwrite(ts, sizeof(int64_t), N_EVENTS, decoded_ts_file);
-		fwrite(addr, sizeof(uint16_t), N_EVENTS, decoded_addr_file);
+		fwrite(ts, sizeof(int64_t), len, decoded_ts_file);
+		fwrite(addr, sizeof(uint16_t), len, decoded_addr_file);
 #endif
 
 		clear_last_N_chars(last_chars);
 		last_chars = printf("done.              \n");
+
+#if RECOVER_ON_OVERLOAD
+		if(len < N_EVENTS) {
+			r--; //< a partial chunk does not count as a repetition
+		}
+#endif
+#if LOAD_SHEDDING
+		// shed the hottest pixels when the camera memory is filling up; turn them on again, the
+		// last shed first, after a while of quiet acquisition. Both the actions stop the
+		// acquisition: data left in the camera memory is downloaded before restarting, and the
+		// stop time is recorded as a gap. Skipped on the last chunk.
+		if(!stopped && r < N_REPETITIONS - 1) {
+			uint16_t n_prev = n_off;
+			if(aval_events >= SHED_FILL_THRESHOLD) {
+				n_off = shed_hot_pixels(pix_counts, off_list, n_off,
+				                        min(SHED_STEP_PIXELS, n_bad + SHED_MAX_PIXELS - n_off));
+				quiet_chunks = 0;
+			} else if(aval_events < SHED_RESTORE_FILL && n_off > n_bad && SHED_RESTORE_CHUNKS > 0) {
+				if(++quiet_chunks >= SHED_RESTORE_CHUNKS) {
+					n_off = max(n_bad, n_off - SHED_STEP_PIXELS);
+				}
+			} else {
+				quiet_chunks = 0;
+			}
+			if(n_off != n_prev) {
+				stat = QMIC_Stop(q);
+				CHECK_ERR_ESCAPE(stat, "QMIC_Stop");
+				stopped = TRUE;
+				gap_pending = TRUE;
+			}
+		}
+#endif
 	}
 
 	stat = QMIC_GetFrameLenHistogram(q, FLhist, NULL);   //< get distribution of frame length of the
@@ -277,6 +478,11 @@ escape: //< jump to here on error after successful initialization. This allow to
 	fclose(decoded_ts_file);
 	fclose(decoded_addr_file);
 #endif
+#if SAVE_CAMERA_DATA && RECOVER_ON_OVERLOAD
+	if(camera_gaps_file != NULL) {
+		fclose(camera_gaps_file);
+	}
+#endif
 #if DECODE_DATA
 	free(ts);
 	ts = NULL;
@@ -337,3 +543,33 @@ void draw_map(uint32_t *frame, uint8_t first_line) {
 	wprintf(map);
 	_setmode(_fileno(stdout), _O_TEXT);
 }
+
+// host_time_2ns returns the host time in the same units of the decoded timestamps (2 ns).
+int64_t host_time_2ns(void) {
+	LARGE_INTEGER cnt, freq;
+	QueryPerformanceCounter(&cnt);
+	QueryPerformanceFrequency(&freq);
+	return (int64_t)(cnt.QuadPart * (5e8 / freq.QuadPart));
+}
+
+// shed_hot_pixels appends to off_list the n_shed pixels with the highest counts, skipping the
+// pixels already in the list. It returns the new length of the list.
+uint16_t shed_hot_pixels(uint32_t *counts, uint16_t *off_list, uint16_t n_off, uint16_t n_shed) {
+	for(int k = 0; k < n_off; k++) {
+		counts[off_list[k]] = 0;
+	}
+	for(int s = 0; s < n_shed; s++) {
+		int hot = 0;
+		for(int p = 1; p < QMIC_NPIXELS; p++) {
+			if(counts[p] > counts[hot]) {
+				hot = p;
+			}
+		}
+		if(counts[hot] == 0) {
+			break; //< no more active pixels to shed
+		}
+		counts[hot] = 0;
+		off_list[n_off++] = (uint16_t)hot;
+	}
+	return n_off;
+}